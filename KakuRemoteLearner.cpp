@@ -0,0 +1,264 @@
+/*
+ * KakuRemoteLearner.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: agent
+ */
+
+#include "include/KakuRemoteLearner.h"
+
+#include <cstddef>
+#include <cstring>
+
+#include "nvs.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static const char* TAG = "kakulearn";
+
+#define BURST_GAP_US	250000	// Frames of a single burst follow each other within ~100ms. A longer gap starts a new burst
+#define NVS_KEY			"profiles"
+#define NVS_VERSION		2		// Must be increased whenever the layout of StoredProfile or KakuRemoteProfile changes
+
+struct StoredProfile {
+	KakuRemoteProfile profile;
+	uint8_t burstHistory[KakuRemoteLearner::BURST_HISTORY];
+	uint8_t historyLength;
+	uint8_t historyNext;
+};
+
+// Layout of the NVS blob. Only the learned profiles are stored, so the blob is shorter than this struct.
+struct StoredProfiles {
+	uint16_t version;
+	uint16_t profileSize;
+	StoredProfile profiles[KakuRemoteLearner::MAX_PROFILES];
+};
+
+KakuRemoteLearner::KakuRemoteLearner() {
+}
+
+void KakuRemoteLearner::setLearning(bool learning) {
+	this->learning = learning;
+}
+
+void KakuRemoteLearner::process(const KakuRemoteEvent& event) {
+	if (!this->learning || event.code.isEcho || event.code.period < MIN_PERIOD_US || event.code.period > MAX_PERIOD_US)
+		return;
+
+	portENTER_CRITICAL(&this->mux);
+
+	Entry* entry = nullptr;
+	Entry* oldest = &this->entries[0];
+	for (size_t i = 0; i < this->numEntries; i++) {
+		if (this->entries[i].profile.address == event.code.address) {
+			entry = &this->entries[i];
+			break;
+		}
+		if (this->entries[i].lastTimestamp < oldest->lastTimestamp) {
+			oldest = &this->entries[i];
+		}
+	}
+
+	if (entry == nullptr) {
+		entry = this->numEntries < MAX_PROFILES ? &this->entries[this->numEntries++] : oldest;
+		*entry = {};
+		entry->profile.address = event.code.address;
+	}
+
+	this->completeBurst(*entry, event.timestamp);
+	if (entry->burstFrames < UINT8_MAX) {
+		entry->burstFrames++;
+	}
+
+	// Average the measured period, with the latest measurement having a weight of 1/8
+	if (entry->profile.periodUs == 0) {
+		entry->profile.periodUs = event.code.period;
+	} else {
+		entry->profile.periodUs = (entry->profile.periodUs * 7 + event.code.period + 4) / 8;
+	}
+	entry->lastTimestamp = event.timestamp;
+
+	portEXIT_CRITICAL(&this->mux);
+}
+
+void KakuRemoteLearner::process(const KakuRemoteEvent* events, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		this->process(events[i]);
+	}
+}
+
+void KakuRemoteLearner::completeBurst(Entry& entry, int64_t now) {
+	if (entry.burstFrames == 0 || now - entry.lastTimestamp <= BURST_GAP_US) {
+		return;
+	}
+
+	entry.burstHistory[entry.historyNext] = entry.burstFrames;
+	entry.historyNext = (entry.historyNext + 1) % BURST_HISTORY;
+	if (entry.historyLength < BURST_HISTORY) {
+		entry.historyLength++;
+	}
+	entry.burstFrames = 0;
+	if (entry.profile.bursts < UINT8_MAX) {
+		entry.profile.bursts++;
+	}
+
+	// Use the median, so a single long press or a single badly received burst doesn't change the profile
+	uint8_t sorted[BURST_HISTORY];
+	for (size_t i = 0; i < entry.historyLength; i++) {
+		size_t j = i;
+		for (; j > 0 && sorted[j - 1] > entry.burstHistory[i]; j--) {
+			sorted[j] = sorted[j - 1];
+		}
+		sorted[j] = entry.burstHistory[i];
+	}
+	uint8_t median = sorted[entry.historyLength / 2];
+
+	// The first frame of a burst is only used to synchronize on, so the remote sent one frame more than we decoded
+	entry.profile.repeats = median < UINT8_MAX ? median + 1 : median;
+}
+
+bool KakuRemoteLearner::getProfile(uint32_t address, KakuRemoteProfile& profile) {
+	bool found = false;
+
+	int64_t now = esp_timer_get_time();
+
+	portENTER_CRITICAL(&this->mux);
+	for (size_t i = 0; i < this->numEntries; i++) {
+		if (this->entries[i].profile.address == address) {
+			this->completeBurst(this->entries[i], now);
+			profile = this->entries[i].profile;
+			found = true;
+			break;
+		}
+	}
+	portEXIT_CRITICAL(&this->mux);
+
+	return found;
+}
+
+size_t KakuRemoteLearner::getProfiles(KakuRemoteProfile* profiles, size_t maxProfiles) {
+	int64_t now = esp_timer_get_time();
+
+	portENTER_CRITICAL(&this->mux);
+	size_t count = this->numEntries < maxProfiles ? this->numEntries : maxProfiles;
+	for (size_t i = 0; i < count; i++) {
+		this->completeBurst(this->entries[i], now);
+		profiles[i] = this->entries[i].profile;
+	}
+	portEXIT_CRITICAL(&this->mux);
+
+	return count;
+}
+
+void KakuRemoteLearner::clear() {
+	portENTER_CRITICAL(&this->mux);
+	this->numEntries = 0;
+	portEXIT_CRITICAL(&this->mux);
+}
+
+esp_err_t KakuRemoteLearner::load(const char* nvsNamespace) {
+	nvs_handle handle;
+	esp_err_t err = nvs_open(nvsNamespace, NVS_READONLY, &handle);
+	if (err != ESP_OK) {
+		return err;
+	}
+
+	StoredProfiles stored;
+	size_t size = sizeof(stored);
+	err = nvs_get_blob(handle, NVS_KEY, &stored, &size);
+	nvs_close(handle);
+	if (err != ESP_OK) {
+		return err;
+	}
+	if (size < offsetof(StoredProfiles, profiles) || stored.version != NVS_VERSION || stored.profileSize != sizeof(StoredProfile)) {
+		return ESP_ERR_INVALID_VERSION;
+	}
+	size -= offsetof(StoredProfiles, profiles);
+	if (size % sizeof(StoredProfile) != 0) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+	size_t count = size / sizeof(StoredProfile);
+
+	portENTER_CRITICAL(&this->mux);
+	this->numEntries = count;
+	for (size_t i = 0; i < count; i++) {
+		Entry& entry = this->entries[i];
+		entry = {};
+		entry.profile = stored.profiles[i].profile;
+		memcpy(entry.burstHistory, stored.profiles[i].burstHistory, BURST_HISTORY);
+		entry.historyLength = stored.profiles[i].historyLength < BURST_HISTORY ? stored.profiles[i].historyLength : BURST_HISTORY;
+		entry.historyNext = stored.profiles[i].historyNext % BURST_HISTORY;
+	}
+	portEXIT_CRITICAL(&this->mux);
+
+	ESP_LOGD(TAG, "Loaded %d profiles", (int)count);
+	return ESP_OK;
+}
+
+esp_err_t KakuRemoteLearner::save(const char* nvsNamespace) {
+	StoredProfiles stored;
+	stored.version = NVS_VERSION;
+	stored.profileSize = sizeof(StoredProfile);
+
+	int64_t now = esp_timer_get_time();
+
+	portENTER_CRITICAL(&this->mux);
+	size_t count = this->numEntries;
+	for (size_t i = 0; i < count; i++) {
+		Entry& entry = this->entries[i];
+		this->completeBurst(entry, now);
+		stored.profiles[i].profile = entry.profile;
+		memcpy(stored.profiles[i].burstHistory, entry.burstHistory, BURST_HISTORY);
+		stored.profiles[i].historyLength = entry.historyLength;
+		stored.profiles[i].historyNext = entry.historyNext;
+	}
+	portEXIT_CRITICAL(&this->mux);
+
+	nvs_handle handle;
+	esp_err_t err = nvs_open(nvsNamespace, NVS_READWRITE, &handle);
+	if (err != ESP_OK) {
+		return err;
+	}
+
+	err = nvs_set_blob(handle, NVS_KEY, &stored, offsetof(StoredProfiles, profiles) + count * sizeof(StoredProfile));
+	if (err == ESP_OK) {
+		err = nvs_commit(handle);
+	}
+	nvs_close(handle);
+
+	ESP_LOGD(TAG, "Saved %d profiles", (int)count);
+	return err;
+}
+
+void KakuRemoteLearner::onEvent(const KakuRemoteEvent* event, void* learner) {
+	((KakuRemoteLearner*)learner)->process(*event);
+}
+
+//C api
+kaku_remote_learner kaku_remote_learner_alloc() {
+	return (kaku_remote_learner)new KakuRemoteLearner();
+}
+
+void kaku_remote_learner_free(kaku_remote_learner handle) {
+	delete ((KakuRemoteLearner*)handle);
+}
+
+void kaku_remote_learner_process(kaku_remote_learner handle, const KakuRemoteEvent* events, size_t count) {
+	((KakuRemoteLearner*)handle)->process(events, count);
+}
+
+void kaku_remote_learner_set_learning(kaku_remote_learner handle, bool learning) {
+	((KakuRemoteLearner*)handle)->setLearning(learning);
+}
+
+bool kaku_remote_learner_get_profile(kaku_remote_learner handle, uint32_t address, KakuRemoteProfile* profile) {
+	return ((KakuRemoteLearner*)handle)->getProfile(address, *profile);
+}
+
+esp_err_t kaku_remote_learner_load(kaku_remote_learner handle, const char* nvs_namespace) {
+	return ((KakuRemoteLearner*)handle)->load(nvs_namespace);
+}
+
+esp_err_t kaku_remote_learner_save(kaku_remote_learner handle, const char* nvs_namespace) {
+	return ((KakuRemoteLearner*)handle)->save(nvs_namespace);
+}
@@ -14,12 +14,19 @@
 
 static const char* TAG = "kakurx";
 
+#define ECHO_HOLD_US		50000	// Time after the end of a transmission in which its echo can still be decoded
+#define ACTIVITY_MIN_STATE	10		// Decoder state from which a signal is considered KAKU activity (sync, start and two bits)
+#define ADDRESS_PERIODS		208		// Total duration of the 26 address bits in periods. Every bit is 1T+1T+1T+5T
+
 int KakuRemoteReceiver::nextInstanceId = 0;
 
 KakuRemoteReceiver::KakuRemoteReceiver(gpio_num_t gpioNum)
-: gpioNum(gpioNum) {
+: eventRingHead(0), batchTail(0), dispatchTail(0), batchConsumer(false), dispatchCallbacks(false),
+  stopping(false), enabled(true), activeInterrupts(0), gpioNum(gpioNum) {
 
-	this->queue = xQueueCreate(256, sizeof(KakuRemoteCode));
+	this->batchLock = xSemaphoreCreateMutex();
+	this->eventsAvailable = xSemaphoreCreateBinary();
+	this->taskStopped = xSemaphoreCreateBinary();
 
 	assert(this->taskHandle == nullptr);
 
@@ -28,10 +35,41 @@ KakuRemoteReceiver::KakuRemoteReceiver(gpio_num_t gpioNum)
 	this->taskName = ss.str();
 
 	xTaskCreatePinnedToCore(&KakuRemoteReceiver::receiveBootstrap, taskName.c_str(), 6144, this, 15, &this->taskHandle, (portNUM_PROCESSORS - 1));
+
+	gpio_pad_select_gpio(this->gpioNum);
+	gpio_set_direction(this->gpioNum, GPIO_MODE_INPUT);
+	gpio_set_intr_type(this->gpioNum, GPIO_INTR_ANYEDGE);
+	gpio_pulldown_dis(this->gpioNum);
+	gpio_pullup_dis(this->gpioNum);
+	ESP_LOGD(TAG, "Configured io %d", this->gpioNum);
+
+	gpio_install_isr_service(ESP_INTR_FLAG_EDGE);
+	gpio_isr_handler_add(this->gpioNum, KakuRemoteReceiver::interruptBootstrap, this);
 }
 
 KakuRemoteReceiver::~KakuRemoteReceiver() {
+	this->enabled = false;
+	gpio_isr_handler_remove(this->gpioNum);
+
+	// Wait for isrs that might still be running on the other core. This covers every isr that counted itself before the
+	// count was seen at zero. An isr the gpio driver dispatched just before the handler was removed, but that did not reach
+	// the counter yet, is not covered by the count. The extra tick is far longer than the driver needs to call the handler.
+	while (this->activeInterrupts.load() != 0) {
+		vTaskDelay(1);
+	}
+	vTaskDelay(1);
 
+	// Let the receiver task leave its loop outside of any callback, and wait until it did
+	this->stopping = true;
+	xTaskNotifyGive(this->taskHandle);
+	xSemaphoreTake(this->taskStopped, portMAX_DELAY);
+
+	// Make sure no batch consumer is still copying events
+	xSemaphoreTake(this->batchLock, portMAX_DELAY);
+
+	vSemaphoreDelete(this->taskStopped);
+	vSemaphoreDelete(this->eventsAvailable);
+	vSemaphoreDelete(this->batchLock);
 }
 
 void KakuRemoteReceiver::setEnabled(bool enabled) {
@@ -40,28 +78,157 @@ void KakuRemoteReceiver::setEnabled(bool enabled) {
 
 void KakuRemoteReceiver::addCallback(CallBack callback) {
 	this->callbacks.push_back(callback);
+	this->startDispatch();
 }
 
-void KakuRemoteReceiver::receive() {
-	gpio_pad_select_gpio(this->gpioNum);
-	gpio_set_direction(this->gpioNum, GPIO_MODE_INPUT);
-	gpio_set_intr_type(this->gpioNum, GPIO_INTR_ANYEDGE);
-	gpio_pulldown_dis(this->gpioNum);
-	gpio_pullup_dis(this->gpioNum);
-	ESP_LOGD(TAG, "Configured io %d", this->gpioNum);
+void KakuRemoteReceiver::startDispatch() {
+	if (this->dispatchCallbacks.load()) {
+		return;
+	}
 
-	gpio_install_isr_service(ESP_INTR_FLAG_EDGE);
-	gpio_isr_handler_add(this->gpioNum, KakuRemoteReceiver::interruptBootstrap, this);
+	// Older events might already be overwritten for a batch consumer's cursor, so start where the batch consumer is
+	if (this->batchConsumer.load()) {
+		this->dispatchTail.store(this->batchTail.load());
+	}
+	this->dispatchCallbacks.store(true);
+
+	// Hand pending events to the receiver task
+	xTaskNotifyGive(this->taskHandle);
+}
+
+void KakuRemoteReceiver::addCallback(EventCallBack callback, void* context) {
+	this->eventCallbacks.push_back({callback, context});
+	this->startDispatch();
+}
+
+void KakuRemoteReceiver::setEchoMode(EchoMode mode) {
+	this->echoMode = mode;
+}
+
+void KakuRemoteReceiver::beginTransmission(uint64_t identity) {
+	portENTER_CRITICAL(&this->echoMux);
+	this->echoIdentity = identity;
+	this->echoUntil = INT64_MAX;
+	portEXIT_CRITICAL(&this->echoMux);
+	this->transmitting = true;
+}
+
+void KakuRemoteReceiver::endTransmission() {
+	portENTER_CRITICAL(&this->echoMux);
+	this->echoUntil = esp_timer_get_time() + ECHO_HOLD_US;
+	portEXIT_CRITICAL(&this->echoMux);
+	this->transmitting = false;
+}
+
+bool KakuRemoteReceiver::isChannelBusy(uint32_t quietUs) {
+	return (uint32_t)esp_timer_get_time() - this->lastActivity < quietUs;
+}
+
+bool KakuRemoteReceiver::isEcho(uint64_t identity) {
+	portENTER_CRITICAL_ISR(&this->echoMux);
+	bool echo = identity == this->echoIdentity && (int64_t)edgeTimeStamp[1] <= this->echoUntil;
+	portEXIT_CRITICAL_ISR(&this->echoMux);
+	return echo;
+}
+
+size_t KakuRemoteReceiver::receiveEvents(KakuRemoteEvent* events, size_t maxEvents, TickType_t timeout) {
+	TimeOut_t timeOut;
+	vTaskSetTimeOutState(&timeOut);
 
 	while(true) {
-		KakuRemoteCode event;
-		xQueueReceive(this->queue, &event, portMAX_DELAY);
+		size_t count = this->takeBatch(events, maxEvents);
+		if (count > 0 || xTaskCheckForTimeOut(&timeOut, &timeout) != pdFALSE) {
+			return count;
+		}
 
-		ESP_LOGV(TAG, "Received event: address=%d, unit=%d, isGroup=%d, isDim=%d, isOn=%d, dimLevel=%d, repeat=%d", event.address, event.unit, event.isGroup, event.isDim, event.isOn, event.dimLevel, event.repeat);
-		for(auto callback : this->callbacks) {
-			callback(event);
+		// The semaphore might still be given for events that were already taken, so always check the ring again.
+		xSemaphoreTake(this->eventsAvailable, timeout);
+	}
+}
+
+size_t KakuRemoteReceiver::pollEvents(KakuRemoteEvent* events, size_t maxEvents) {
+	return this->takeBatch(events, maxEvents);
+}
+
+size_t KakuRemoteReceiver::takeBatch(KakuRemoteEvent* events, size_t maxEvents) {
+	xSemaphoreTake(this->batchLock, portMAX_DELAY);
+
+	if (!this->batchConsumer.load()) {
+		// Older events might already be overwritten for the receiver task's cursor, so start where the receiver task is
+		if (this->dispatchCallbacks.load()) {
+			this->batchTail.store(this->dispatchTail.load());
 		}
+		this->batchConsumer.store(true);
+	}
+	size_t count = this->takeEvents(this->batchTail, events, maxEvents);
+
+	xSemaphoreGive(this->batchLock);
+	return count;
+}
+
+size_t KakuRemoteReceiver::takeEvents(std::atomic<uint32_t>& tail, KakuRemoteEvent* events, size_t maxEvents) {
+	uint32_t current = tail.load(std::memory_order_relaxed);
+	uint32_t pending = this->eventRingHead.load(std::memory_order_acquire) - current;
+	size_t count = pending < maxEvents ? pending : maxEvents;
+	for (size_t i = 0; i < count; i++) {
+		events[i] = this->eventRing[(current + i) & (EVENT_RING_SIZE - 1)];
 	}
+	tail.store(current + count, std::memory_order_release);
+
+	return count;
+}
+
+void KakuRemoteReceiver::pushEvent() {
+	bool batch = this->batchConsumer.load(std::memory_order_relaxed);
+	bool dispatch = this->dispatchCallbacks.load(std::memory_order_relaxed);
+
+	// Until a consumer started, the ring holds on to the oldest events, for whichever consumer comes first
+	uint32_t head = this->eventRingHead.load(std::memory_order_relaxed);
+	if (((batch || !dispatch) && head - this->batchTail.load(std::memory_order_acquire) >= EVENT_RING_SIZE) ||
+		((dispatch || !batch) && head - this->dispatchTail.load(std::memory_order_acquire) >= EVENT_RING_SIZE)) {
+		// A consumer is not draining the events fast enough. Drop the newest, like a full queue would.
+		return;
+	}
+
+	KakuRemoteEvent& event = this->eventRing[head & (EVENT_RING_SIZE - 1)];
+	event.code = currentCode;
+	event.timestamp = edgeTimeStamp[1];
+	event.gpioNum = this->gpioNum;
+	this->eventRingHead.store(head + 1, std::memory_order_release);
+
+	BaseType_t higherPriorityTaskWoken = pdFALSE;
+	if (dispatch) {
+		vTaskNotifyGiveFromISR(this->taskHandle, &higherPriorityTaskWoken);
+	}
+	xSemaphoreGiveFromISR(this->eventsAvailable, &higherPriorityTaskWoken);
+	if (higherPriorityTaskWoken) {
+		portYIELD_FROM_ISR();
+	}
+}
+
+void KakuRemoteReceiver::receive() {
+	KakuRemoteEvent events[DISPATCH_BATCH_SIZE];
+	while(!this->stopping) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+		size_t count;
+		while (!this->stopping && (count = this->takeEvents(this->dispatchTail, events, DISPATCH_BATCH_SIZE)) > 0) {
+			for (size_t i = 0; i < count; i++) {
+				KakuRemoteCode& code = events[i].code;
+				ESP_LOGV(TAG, "Received event: address=%d, unit=%d, isGroup=%d, isDim=%d, isOn=%d, dimLevel=%d, repeat=%d", code.address, code.unit, code.isGroup, code.isDim, code.isOn, code.dimLevel, code.repeat);
+				for(auto callback : this->callbacks) {
+					callback(code);
+				}
+				for(auto& entry : this->eventCallbacks) {
+					entry.callback(&events[i], entry.context);
+				}
+			}
+		}
+	}
+
+	// The destructor waits for this, after which the receiver is no longer touched by this task
+	xSemaphoreGive(this->taskStopped);
+	vTaskDelete(nullptr);
 }
 
 void KakuRemoteReceiver::onInterrupt() {
@@ -116,7 +283,10 @@ void KakuRemoteReceiver::onInterrupt() {
 		// Start-bit passed. Do some clean-up.
 		currentCode.address = 0;
 		currentCode.unit = 0;
+		currentCode.isDim = false;
+		currentCode.isOn = false;
 		currentCode.dimLevel = 0;
+		addressDuration = 0;
 	} else if (state == 1) { // Verify start bit part 2 of 2
 		// Duration must be ~10.44T
 		if (duration < 7 * currentCode.period || duration > 15 * currentCode.period) {
@@ -126,6 +296,12 @@ void KakuRemoteReceiver::onInterrupt() {
 	}else if (state < 148) { // state 146 is first edge of stop-sequence. All bits before that adhere to default protocol, with exception of dim-bit
 		receivedBit <<= 1;
 
+		if (state < 106) {
+			// The sum of all address bit parts is always 208T, even when high signals linger. This measures the period
+			// a lot more accurate than the sync signal.
+			addressDuration += duration;
+		}
+
 		// One bit consists out of 4 bit parts.
 		// bit part durations can ONLY be 1 or 5 periods.
 		if (duration <= max1Period) {
@@ -146,18 +322,18 @@ void KakuRemoteReceiver::onInterrupt() {
 				}
 
 				// a valid signal was found!
-				if (
-						currentCode.address != lastCode.address ||
-						currentCode.unit != lastCode.unit ||
-						currentCode.isDim != lastCode.isDim ||
-						currentCode.dimLevel != lastCode.dimLevel ||
-						currentCode.isGroup != lastCode.isGroup
-					) { // memcmp isn't deemed safe
+				currentCode.period = addressDuration / ADDRESS_PERIODS;
+
+				uint64_t identity = kaku_remote_code_identity(currentCode);
+				if (identity != lastIdentity) {
 					currentCode.repeat = 0;
-					lastCode = currentCode;
+					lastIdentity = identity;
 				}
 
-				xQueueSendToBackFromISR(this->queue, &currentCode, nullptr);
+				currentCode.isEcho = isEcho(identity);
+				if (!currentCode.isEcho || echoMode != KAKU_REMOTE_ECHO_SUPPRESS) {
+					pushEvent();
+				}
 
 				currentCode.repeat++;
 
@@ -265,6 +441,10 @@ void KakuRemoteReceiver::onInterrupt() {
 	}
 
 	state++;
+
+	if (state >= ACTIVITY_MIN_STATE && !transmitting) {
+		lastActivity = edgeTimeStamp[2];
+	}
 }
 
 void KakuRemoteReceiver::receiveBootstrap(void* instance) {
@@ -272,17 +452,43 @@ void KakuRemoteReceiver::receiveBootstrap(void* instance) {
 }
 
 void KakuRemoteReceiver::interruptBootstrap(void* instance) {
+	KakuRemoteReceiver* receiver = (KakuRemoteReceiver*)instance;
 
-	((KakuRemoteReceiver*)instance)->onInterrupt();
+	// Count first, and only then check enabled (in onInterrupt), so the destructor can wait for isrs that are still running.
+	receiver->activeInterrupts.fetch_add(1);
+	receiver->onInterrupt();
+	receiver->activeInterrupts.fetch_sub(1);
 }
 
 //C Api
+kaku_remote_rx kaku_remote_rx_alloc(gpio_num_t ionum) {
+	return (kaku_remote_rx)new KakuRemoteReceiver(ionum);
+}
+
+void kaku_remote_rx_free(kaku_remote_rx handle) {
+	delete ((KakuRemoteReceiver*)handle);
+}
+
+void kaku_remote_rx_set_enabled(kaku_remote_rx handle, bool enabled) {
+	((KakuRemoteReceiver*)handle)->setEnabled(enabled);
+}
+
+void kaku_remote_rx_add_callback(kaku_remote_rx handle, kaku_remote_rx_callback callback, void* context) {
+	((KakuRemoteReceiver*)handle)->addCallback(callback, context);
+}
+
+size_t kaku_remote_rx_poll(kaku_remote_rx handle, KakuRemoteEvent* events, size_t max_events) {
+	return ((KakuRemoteReceiver*)handle)->pollEvents(events, max_events);
+}
+
+size_t kaku_remote_rx_receive(kaku_remote_rx handle, KakuRemoteEvent* events, size_t max_events, TickType_t timeout) {
+	return ((KakuRemoteReceiver*)handle)->receiveEvents(events, max_events, timeout);
+}
+
+void kaku_remote_rx_set_echo_mode(kaku_remote_rx handle, kaku_remote_echo_mode mode) {
+	((KakuRemoteReceiver*)handle)->setEchoMode(mode);
+}
+
 bool kaku_remote_code_is_equal(KakuRemoteCode code1, KakuRemoteCode code2) {
-	return code1.address == code2.address &&
-			code1.dimLevel == code2.dimLevel &&
-			code1.isDim == code2.isDim &&
-			code1.isGroup == code2.isGroup &&
-			code1.isOn == code2.isOn &&
-			code1.unit == code2.unit &&
-			code1.period == code2.period;
+	return kaku_remote_code_identity(code1) == kaku_remote_code_identity(code2);
 }
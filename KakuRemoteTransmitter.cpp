@@ -6,8 +6,11 @@
  */
 
 #include "include/KakuRemoteTransmitter.h"
+#include "include/KakuRemoteReceiver.h"
+#include "include/KakuRemoteLearner.h"
 
 #include "esp_log.h"
+#include "esp_system.h"
 
 static const char* TAG = "kakutx";
 
@@ -15,6 +18,13 @@ static const char* TAG = "kakutx";
 #define RMT_CLK_DIVIDER      100
 #define RMT_TICK_10_US    (80000000/RMT_CLK_DIVIDER/100000)   //Number of ticks needed for a 10 microseconds period
 
+//Learned profiles never use fewer repeats than this, as 2 or lower is highly unstable
+#define LEARNED_MIN_REPEATS	3
+
+//Backoff used while waiting for a quiet channel. It doubles after every busy check, with random jitter added
+#define LBT_MIN_BACKOFF_MS	10
+#define LBT_MAX_BACKOFF_MS	160
+
 KakuRemoteTransmitter::KakuRemoteTransmitter(rmt_channel_t rmtChannel, gpio_num_t gpioNum, uint16_t periodUs, uint8_t repeats)
 : rmtChannel(rmtChannel), gpioNum(gpioNum), periodUs(periodUs), repeats(repeats) {
 
@@ -43,142 +53,231 @@ void KakuRemoteTransmitter::initializeRmt() {
 }
 
 void KakuRemoteTransmitter::sendGroup(uint32_t address, bool switchOn) {
+	uint16_t periodTick;
+	uint8_t repeats;
+	this->resolveProfile(address, periodTick, repeats);
+
 	int numItems = 66;
 	rmt_item32_t items[numItems];
 	rmt_item32_t* currentItem = items;
 
-	this->sendStart(currentItem++);
-	this->sendAddress(currentItem, address);
+	this->sendStart(currentItem++, periodTick);
+	this->sendAddress(currentItem, address, periodTick);
 	currentItem += 52;
-	this->sendBit(currentItem, true);
+	this->sendBit(currentItem, true, periodTick);
 	currentItem += 2;
-	this->sendBit(currentItem, switchOn);
+	this->sendBit(currentItem, switchOn, periodTick);
 	currentItem += 2;
-	this->sendUnit(currentItem, 0);
+	this->sendUnit(currentItem, 0, periodTick);
 	currentItem += 8;
-	this->sendStop(currentItem);
+	this->sendStop(currentItem, periodTick);
 
-	for(int i = 0; i < this->repeats; i++) {
-		ESP_LOGV(TAG, "Sending group signal: address=%d, on=%d, repeat=%d", address, switchOn, i);
-		rmt_write_items(this->rmtChannel, items, numItems, true);
-		rmt_wait_tx_done(this->rmtChannel, portMAX_DELAY);
-	}
+	KakuRemoteCode code = {};
+	code.address = address;
+	code.isGroup = true;
+	code.isOn = switchOn;
+
+	ESP_LOGV(TAG, "Sending group signal: address=%d, on=%d", address, switchOn);
+	this->transmit(items, numItems, kaku_remote_code_identity(code), repeats);
 }
 
 void KakuRemoteTransmitter::sendUnit(uint32_t address, uint8_t unit, bool switchOn) {
+	uint16_t periodTick;
+	uint8_t repeats;
+	this->resolveProfile(address, periodTick, repeats);
+
 	int numItems = 66;
 	rmt_item32_t items[numItems];
 	rmt_item32_t* currentItem = items;
 
-	this->sendStart(currentItem++);
-	this->sendAddress(currentItem, address);
+	this->sendStart(currentItem++, periodTick);
+	this->sendAddress(currentItem, address, periodTick);
 	currentItem += 52;
-	this->sendBit(currentItem, false);
+	this->sendBit(currentItem, false, periodTick);
 	currentItem += 2;
-	this->sendBit(currentItem, switchOn);
+	this->sendBit(currentItem, switchOn, periodTick);
 	currentItem += 2;
-	this->sendUnit(currentItem, unit);
+	this->sendUnit(currentItem, unit, periodTick);
 	currentItem += 8;
-	this->sendStop(currentItem);
+	this->sendStop(currentItem, periodTick);
 
-	for(int i = 0; i < this->repeats; i++) {
-		ESP_LOGV(TAG, "Sending unit signal: address=%d, unit=%d, on=%d, repeat=%d", address, unit, switchOn, i);
-		rmt_write_items(this->rmtChannel, items, numItems, true);
-		rmt_wait_tx_done(this->rmtChannel, portMAX_DELAY);
-	}
+	KakuRemoteCode code = {};
+	code.address = address;
+	code.unit = unit;
+	code.isOn = switchOn;
+
+	ESP_LOGV(TAG, "Sending unit signal: address=%d, unit=%d, on=%d", address, unit, switchOn);
+	this->transmit(items, numItems, kaku_remote_code_identity(code), repeats);
 }
 
 void KakuRemoteTransmitter::sendDim(uint32_t address, uint8_t unit, uint8_t dimLevel) {
+	uint16_t periodTick;
+	uint8_t repeats;
+	this->resolveProfile(address, periodTick, repeats);
+
 	int numItems = 74;
 	rmt_item32_t items[numItems];
 	rmt_item32_t* currentItem = items;
 
-	this->sendStart(currentItem++);
-	this->sendAddress(currentItem, address);
+	this->sendStart(currentItem++, periodTick);
+	this->sendAddress(currentItem, address, periodTick);
 	currentItem += 52;
-	this->sendBit(currentItem, false);
+	this->sendBit(currentItem, false, periodTick);
 	currentItem += 2;
-	this->sendDim(currentItem);
+	this->sendDim(currentItem, periodTick);
 	currentItem += 2;
-	this->sendUnit(currentItem, unit);
+	this->sendUnit(currentItem, unit, periodTick);
 	currentItem += 8;
 
 	//Send dim information
 	for (short j=3; j>=0; j--) {
-		this->sendBit(currentItem, (dimLevel & 1<<j) != 0);
+		this->sendBit(currentItem, (dimLevel & 1<<j) != 0, periodTick);
 		currentItem += 2;
 	}
 
-	this->sendStop(currentItem);
-	for(int i = 0; i < this->repeats; i++) {
-		ESP_LOGV(TAG, "Sending unit signal: address=%d, unit=%d, dim=%d, repeat=%d", address, unit, dimLevel, i);
+	this->sendStop(currentItem, periodTick);
+
+	KakuRemoteCode code = {};
+	code.address = address;
+	code.unit = unit;
+	code.isDim = true;
+	code.dimLevel = dimLevel;
+
+	ESP_LOGV(TAG, "Sending unit signal: address=%d, unit=%d, dim=%d", address, unit, dimLevel);
+	this->transmit(items, numItems, kaku_remote_code_identity(code), repeats);
+}
+
+void KakuRemoteTransmitter::attachReceiver(KakuRemoteReceiver* receiver, bool listenBeforeTalk, uint32_t quietUs, uint32_t maxWaitMs) {
+	this->receiver = receiver;
+	this->listenBeforeTalk = listenBeforeTalk;
+	this->quietUs = quietUs;
+	this->maxWaitMs = maxWaitMs;
+}
+
+void KakuRemoteTransmitter::waitForQuietChannel() {
+	uint32_t waitedMs = 0;
+	uint32_t backoffMs = LBT_MIN_BACKOFF_MS;
+
+	while (this->receiver->isChannelBusy(this->quietUs)) {
+		if (waitedMs >= this->maxWaitMs) {
+			ESP_LOGD(TAG, "Channel still busy after %dms, sending anyway", waitedMs);
+			return;
+		}
+
+		uint32_t delayMs = backoffMs + esp_random() % backoffMs;
+		vTaskDelay(delayMs/portTICK_PERIOD_MS);
+		waitedMs += delayMs;
+		if (backoffMs < LBT_MAX_BACKOFF_MS) {
+			backoffMs <<= 1;
+		}
+	}
+}
+
+void KakuRemoteTransmitter::setLearner(KakuRemoteLearner* learner) {
+	this->learner = learner;
+}
+
+void KakuRemoteTransmitter::resolveProfile(uint32_t address, uint16_t& periodTick, uint8_t& repeats) {
+	KakuRemoteProfile profile;
+	if (this->learner == nullptr || !this->learner->getProfile(address, profile)
+			|| profile.periodUs < KakuRemoteLearner::MIN_PERIOD_US || profile.periodUs > KakuRemoteLearner::MAX_PERIOD_US) {
+		periodTick = this->periodTick;
+		repeats = this->repeats;
+		return;
+	}
+
+	periodTick = profile.periodUs*RMT_TICK_10_US/10;
+	repeats = profile.repeats == 0 ? this->repeats : profile.repeats;
+	if (repeats < LEARNED_MIN_REPEATS) {
+		repeats = LEARNED_MIN_REPEATS;
+	}
+	if (repeats > this->repeats) {
+		repeats = this->repeats;
+	}
+	ESP_LOGD(TAG, "Using learned profile for address=%d: period=%dus, repeats=%d", address, profile.periodUs, repeats);
+}
+
+void KakuRemoteTransmitter::transmit(const rmt_item32_t* items, int numItems, uint64_t identity, uint8_t repeats) {
+	if (this->receiver != nullptr) {
+		if (this->listenBeforeTalk) {
+			this->waitForQuietChannel();
+		}
+		this->receiver->beginTransmission(identity);
+	}
+
+	for(int i = 0; i < repeats; i++) {
+		ESP_LOGV(TAG, "Sending repeat %d", i);
 		rmt_write_items(this->rmtChannel, items, numItems, true);
 		rmt_wait_tx_done(this->rmtChannel, portMAX_DELAY);
 	}
+
+	if (this->receiver != nullptr) {
+		this->receiver->endTransmission();
+	}
 }
 
-void KakuRemoteTransmitter::sendStart(rmt_item32_t* items) {
+void KakuRemoteTransmitter::sendStart(rmt_item32_t* items, uint16_t periodTick) {
 	//We send T high, 9 T low
-	items[0].duration0 = this->periodTick;
+	items[0].duration0 = periodTick;
 	items[0].level0 = 1;
-	items[0].duration1 = 10*this->periodTick + (this->periodTick>>1);
+	items[0].duration1 = 10*periodTick + (periodTick>>1);
 	items[0].level1 = 0;
 }
 
-void KakuRemoteTransmitter::sendStop(rmt_item32_t* items) {
+void KakuRemoteTransmitter::sendStop(rmt_item32_t* items, uint16_t periodTick) {
 	//We send T high, 40 T low
-	items[0].duration0 = this->periodTick;
+	items[0].duration0 = periodTick;
 	items[0].level0 = 1;
-	items[0].duration1 = 40*this->periodTick;
+	items[0].duration1 = 40*periodTick;
 	items[0].level1 = 0;
 }
 
-void KakuRemoteTransmitter::sendAddress(rmt_item32_t* items, uint32_t address) {
+void KakuRemoteTransmitter::sendAddress(rmt_item32_t* items, uint32_t address, uint16_t periodTick) {
 	for (short i=25; i>=0; i--) {
-	   this->sendBit(items, (address >> i) & 1);
+	   this->sendBit(items, (address >> i) & 1, periodTick);
 	   items+=2;
 	}
 }
 
-void KakuRemoteTransmitter::sendUnit(rmt_item32_t* items, uint8_t unit) {
+void KakuRemoteTransmitter::sendUnit(rmt_item32_t* items, uint8_t unit, uint16_t periodTick) {
 	for (short i=3; i>=0; i--) {
-	   this->sendBit(items, unit & 1<<i);
+	   this->sendBit(items, unit & 1<<i, periodTick);
 	   items+=2;
 	}
 }
 
-void KakuRemoteTransmitter::sendBit(rmt_item32_t* items, bool on) {
+void KakuRemoteTransmitter::sendBit(rmt_item32_t* items, bool on, uint16_t periodTick) {
 	if(on) {
 		// Send '1'
-		items[0].duration0 = this->periodTick;
+		items[0].duration0 = periodTick;
 		items[0].level0 = 1;
-		items[0].duration1 = 5*this->periodTick;
+		items[0].duration1 = 5*periodTick;
 		items[0].level1 = 0;
-		items[1].duration0 = this->periodTick;
+		items[1].duration0 = periodTick;
 		items[1].level0 = 1;
-		items[1].duration1 = this->periodTick;
+		items[1].duration1 = periodTick;
 		items[1].level1 = 0;
 	} else {
 		// Send '0'
-		items[0].duration0 = this->periodTick;
+		items[0].duration0 = periodTick;
 		items[0].level0 = 1;
-		items[0].duration1 = this->periodTick;
+		items[0].duration1 = periodTick;
 		items[0].level1 = 0;
-		items[1].duration0 = this->periodTick;
+		items[1].duration0 = periodTick;
 		items[1].level0 = 1;
-		items[1].duration1 = 5*this->periodTick;
+		items[1].duration1 = 5*periodTick;
 		items[1].level1 = 0;
 	}
 }
 
-void KakuRemoteTransmitter::sendDim(rmt_item32_t* items) {
-	items[0].duration0 = this->periodTick;
+void KakuRemoteTransmitter::sendDim(rmt_item32_t* items, uint16_t periodTick) {
+	items[0].duration0 = periodTick;
 	items[0].level0 = 1;
-	items[0].duration1 = this->periodTick;
+	items[0].duration1 = periodTick;
 	items[0].level1 = 0;
-	items[1].duration0 = this->periodTick;
+	items[1].duration0 = periodTick;
 	items[1].level0 = 1;
-	items[1].duration1 = this->periodTick;
+	items[1].duration1 = periodTick;
 	items[1].level1 = 0;
 }
 
@@ -202,3 +301,11 @@ void kaku_remote_tx_send_unit(kaku_remote_tx handle, uint32_t address, uint8_t u
 void kaku_remote_tx_send_dim(kaku_remote_tx handle, uint32_t address, uint8_t unit, uint8_t dimlvl) {
 	((KakuRemoteTransmitter*)handle)->sendDim(address, unit, dimlvl);
 }
+
+void kaku_remote_tx_attach_rx(kaku_remote_tx handle, void* rx, bool listen_before_talk) {
+	((KakuRemoteTransmitter*)handle)->attachReceiver((KakuRemoteReceiver*)rx, listen_before_talk);
+}
+
+void kaku_remote_tx_set_learner(kaku_remote_tx handle, void* learner) {
+	((KakuRemoteTransmitter*)handle)->setLearner((KakuRemoteLearner*)learner);
+}
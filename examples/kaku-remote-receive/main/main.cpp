@@ -14,10 +14,26 @@ KakuRemoteReceiver receiver(GPIO_NUM_32);
 extern "C"
 void app_main(void)
 {
+	// Our own codes are the only traffic in this example, so tag them as echo instead of dropping them.
+	// Also wait for other remotes to finish before sending.
+	receiver.setEchoMode(KAKU_REMOTE_ECHO_TAG);
+	transmitter.attachReceiver(&receiver, true);
+
 	int i = 0;
+	KakuRemoteEvent events[16];
 	while(true) {
 		ESP_LOGW(TAG, "Sending code...");
 		transmitter.sendGroup(i++, true);
-		vTaskDelay(5000/portTICK_PERIOD_MS);
+
+		// Log everything that is received until it is time to send the next code
+		TickType_t start = xTaskGetTickCount();
+		while (xTaskGetTickCount() - start < 5000/portTICK_PERIOD_MS) {
+			size_t count = receiver.receiveEvents(events, 16, 100/portTICK_PERIOD_MS);
+			for (size_t j = 0; j < count; j++) {
+				KakuRemoteCode& code = events[j].code;
+				ESP_LOGI(TAG, "Received code at %lld: address=%d, unit=%d, isGroup=%d, isOn=%d, repeat=%d, period=%d, isEcho=%d",
+						events[j].timestamp, code.address, code.unit, code.isGroup, code.isOn, code.repeat, code.period, code.isEcho);
+			}
+		}
 	}
 }
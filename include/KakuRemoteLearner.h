@@ -0,0 +1,188 @@
+/*
+ * KakuRemoteLearner.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: agent
+ */
+
+#ifndef KAKUREMOTELEARNER_H
+#define KAKUREMOTELEARNER_H
+
+#include "esp_err.h"
+#include "KakuRemoteReceiver.h"
+
+typedef struct {
+	uint32_t address;	// The 26bit address of the remote
+	uint16_t periodUs;	// The averaged period in microseconds measured from the signals of the remote
+	uint8_t repeats;	// The estimated number of frames the remote sends per burst, 0 until a burst completed. This is the median
+						// number of frames decoded per burst over the last completed bursts, plus the first frame of a burst,
+						// which the receiver only uses to synchronize on
+	uint8_t bursts;		// The number of completed bursts received from the remote, saturating at 255
+} KakuRemoteProfile;
+
+#ifdef __cplusplus
+
+class KakuRemoteLearner {
+public:
+
+	static const size_t MAX_PROFILES = 32;
+	static const size_t BURST_HISTORY = 5;
+	static const uint16_t MIN_PERIOD_US = 150;	// Measured periods outside of this range are not learned
+	static const uint16_t MAX_PERIOD_US = 400;
+
+	/**
+	 * Creates a new, empty table of remote profiles. Learning is enabled by default.
+	 */
+	KakuRemoteLearner();
+
+	/**
+	 * Enables or disables learning. Already learned profiles stay available while learning is disabled.
+	 *
+	 * @param learning	Whether received codes should update the profiles
+	 */
+	void setLearning(bool learning);
+
+	/**
+	 * Updates the profile of the address of the given event. Echoes of our own transmissions are ignored.
+	 * When the table is full, the profile of the remote that was seen least recently is replaced.
+	 *
+	 * The learner does not consume events from a receiver itself. Whoever drains the receiver passes the events on to this method.
+	 *
+	 * @param event	The decoded event to learn from
+	 */
+	void process(const KakuRemoteEvent& event);
+
+	/**
+	 * Updates the profiles for a batch of events, as returned by KakuRemoteReceiver::receiveEvents.
+	 *
+	 * @param events	The decoded events to learn from
+	 * @param count		The number of events in the array
+	 */
+	void process(const KakuRemoteEvent* events, size_t count);
+
+	/**
+	 * Event callback that passes the event to the learner given as context. Can be registered with KakuRemoteReceiver::addCallback.
+	 */
+	static void onEvent(const KakuRemoteEvent* event, void* learner);
+
+	/**
+	 * Looks up the profile of the given address.
+	 *
+	 * @param address	The 26bit address to look up
+	 * @param profile	The profile that is filled when the address was learned
+	 * @return Whether the address was learned
+	 */
+	bool getProfile(uint32_t address, KakuRemoteProfile& profile);
+
+	/**
+	 * Copies up to maxProfiles learned profiles into the given array.
+	 *
+	 * @return The number of profiles written into the array
+	 */
+	size_t getProfiles(KakuRemoteProfile* profiles, size_t maxProfiles);
+
+	/**
+	 * Forgets all learned profiles.
+	 */
+	void clear();
+
+	/**
+	 * Replaces the learned profiles with the ones stored in NVS. NVS must have been initialized using nvs_flash_init.
+	 * Returns ESP_ERR_INVALID_VERSION when the stored profiles were written in another format.
+	 *
+	 * @param nvsNamespace	The NVS namespace in which the profiles were stored
+	 */
+	esp_err_t load(const char* nvsNamespace = "kakuremote");
+
+	/**
+	 * Stores the learned profiles in NVS. NVS must have been initialized using nvs_flash_init.
+	 *
+	 * @param nvsNamespace	The NVS namespace in which the profiles are stored
+	 */
+	esp_err_t save(const char* nvsNamespace = "kakuremote");
+
+private:
+	struct Entry {
+		KakuRemoteProfile profile;
+		int64_t lastTimestamp;
+		uint8_t burstFrames;				// Frames received in the burst that is still in progress
+		uint8_t burstHistory[BURST_HISTORY];	// Frames received in the last completed bursts
+		uint8_t historyLength;
+		uint8_t historyNext;
+	};
+
+	Entry entries[MAX_PROFILES];
+	size_t numEntries = 0;
+	volatile bool learning = true;
+	portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+	void completeBurst(Entry& entry, int64_t now);
+};
+
+extern "C" {
+#endif
+
+typedef void* kaku_remote_learner;
+
+/**
+ * Allocates an empty table of remote profiles, and returns a handle that can be used for learning.
+ *
+ * This handle must be freed by calling kaku_remote_learner_free
+ */
+kaku_remote_learner kaku_remote_learner_alloc();
+
+/**
+ * Used to free all structures behind the given handle. After this call, the handle cannot be used anymore.
+ *
+ * @param handle The handle to the learner
+ */
+void kaku_remote_learner_free(kaku_remote_learner handle);
+
+/**
+ * Updates the profiles for a batch of events, as returned by kaku_remote_rx_poll or kaku_remote_rx_receive.
+ *
+ * @param handle The handle to the learner
+ * @param events	The decoded events to learn from
+ * @param count	The number of events in the array
+ */
+void kaku_remote_learner_process(kaku_remote_learner handle, const KakuRemoteEvent* events, size_t count);
+
+/**
+ * Enables or disables learning.
+ *
+ * @param handle The handle to the learner
+ * @param learning	Whether received codes should update the profiles
+ */
+void kaku_remote_learner_set_learning(kaku_remote_learner handle, bool learning);
+
+/**
+ * Looks up the profile of the given address.
+ *
+ * @param handle The handle to the learner
+ * @param address	The 26bit address to look up
+ * @param profile	The profile that is filled when the address was learned
+ * @return Whether the address was learned
+ */
+bool kaku_remote_learner_get_profile(kaku_remote_learner handle, uint32_t address, KakuRemoteProfile* profile);
+
+/**
+ * Replaces the learned profiles with the ones stored in the given NVS namespace.
+ *
+ * @param handle The handle to the learner
+ * @param nvs_namespace	The NVS namespace in which the profiles were stored
+ */
+esp_err_t kaku_remote_learner_load(kaku_remote_learner handle, const char* nvs_namespace);
+
+/**
+ * Stores the learned profiles in the given NVS namespace.
+ *
+ * @param handle The handle to the learner
+ * @param nvs_namespace	The NVS namespace in which the profiles are stored
+ */
+esp_err_t kaku_remote_learner_save(kaku_remote_learner handle, const char* nvs_namespace);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KAKUREMOTELEARNER_H */
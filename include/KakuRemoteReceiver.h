@@ -10,11 +10,15 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "driver/rmt.h"
+
+#ifdef __cplusplus
 #include <string>
 #include <vector>
 #include <functional>
+#include <atomic>
+#endif
 
 typedef struct {
 	struct {
@@ -26,18 +30,127 @@ typedef struct {
 		uint16_t isDim : 1;
 		uint16_t isOn : 1;
 		uint16_t dimLevel : 4;
-		uint16_t reserved : 1;
+		uint16_t isEcho : 1;
 		uint16_t repeat : 8;
 	};
 	uint16_t period;
 } KakuRemoteCode;
 
+#ifdef __cplusplus
+#define KAKU_REMOTE_CONSTEXPR constexpr
+#else
+#define KAKU_REMOTE_CONSTEXPR
+#endif
+
+/*
+ * Packed 64 bit representation of a KakuRemoteCode. The lower bits hold the identity of the code (the bits that
+ * were actually sent by the remote), the upper bits hold the receive information that differs between repeats.
+ */
+#define KAKU_REMOTE_CODE_ADDRESS_SHIFT		0
+#define KAKU_REMOTE_CODE_UNIT_SHIFT			26
+#define KAKU_REMOTE_CODE_GROUP_SHIFT		30
+#define KAKU_REMOTE_CODE_DIM_SHIFT			31
+#define KAKU_REMOTE_CODE_ON_SHIFT			32
+#define KAKU_REMOTE_CODE_DIMLEVEL_SHIFT		33
+#define KAKU_REMOTE_CODE_ECHO_SHIFT			37
+#define KAKU_REMOTE_CODE_REPEAT_SHIFT		40
+#define KAKU_REMOTE_CODE_PERIOD_SHIFT		48
+#define KAKU_REMOTE_CODE_IDENTITY_MASK		((1ULL << 37) - 1)
+
+/**
+ * Returns the identity of the code: address, unit, group, dim, on and dim level. Two codes with the same identity
+ * represent the same command, regardless of the measured period or the repeat they were received in.
+ */
+static inline KAKU_REMOTE_CONSTEXPR uint64_t kaku_remote_code_identity(KakuRemoteCode code) {
+	return ((uint64_t)code.address << KAKU_REMOTE_CODE_ADDRESS_SHIFT) |
+			((uint64_t)code.unit << KAKU_REMOTE_CODE_UNIT_SHIFT) |
+			((uint64_t)code.isGroup << KAKU_REMOTE_CODE_GROUP_SHIFT) |
+			((uint64_t)code.isDim << KAKU_REMOTE_CODE_DIM_SHIFT) |
+			((uint64_t)code.isOn << KAKU_REMOTE_CODE_ON_SHIFT) |
+			((uint64_t)code.dimLevel << KAKU_REMOTE_CODE_DIMLEVEL_SHIFT);
+}
+
+/**
+ * Packs the complete code, including repeat and period, into a single 64 bit word.
+ */
+static inline KAKU_REMOTE_CONSTEXPR uint64_t kaku_remote_code_pack(KakuRemoteCode code) {
+	return kaku_remote_code_identity(code) |
+			((uint64_t)code.isEcho << KAKU_REMOTE_CODE_ECHO_SHIFT) |
+			((uint64_t)code.repeat << KAKU_REMOTE_CODE_REPEAT_SHIFT) |
+			((uint64_t)code.period << KAKU_REMOTE_CODE_PERIOD_SHIFT);
+}
+
+/**
+ * Unpacks a word created by kaku_remote_code_pack into a code again.
+ */
+#ifdef __cplusplus
+static inline constexpr KakuRemoteCode kaku_remote_code_unpack(uint64_t word) {
+	return KakuRemoteCode {
+		{
+			(uint32_t)(word >> KAKU_REMOTE_CODE_ADDRESS_SHIFT) & 0x3FFFFFF,
+			(uint32_t)(word >> KAKU_REMOTE_CODE_UNIT_SHIFT) & 0xF
+		}, {
+			(uint16_t)((word >> KAKU_REMOTE_CODE_GROUP_SHIFT) & 0x1),
+			(uint16_t)((word >> KAKU_REMOTE_CODE_DIM_SHIFT) & 0x1),
+			(uint16_t)((word >> KAKU_REMOTE_CODE_ON_SHIFT) & 0x1),
+			(uint16_t)((word >> KAKU_REMOTE_CODE_DIMLEVEL_SHIFT) & 0xF),
+			(uint16_t)((word >> KAKU_REMOTE_CODE_ECHO_SHIFT) & 0x1),
+			(uint16_t)((word >> KAKU_REMOTE_CODE_REPEAT_SHIFT) & 0xFF)
+		},
+		(uint16_t)(word >> KAKU_REMOTE_CODE_PERIOD_SHIFT)
+	};
+}
+#else
+static inline KakuRemoteCode kaku_remote_code_unpack(uint64_t word) {
+	KakuRemoteCode code;
+	code.address = (word >> KAKU_REMOTE_CODE_ADDRESS_SHIFT) & 0x3FFFFFF;
+	code.unit = (word >> KAKU_REMOTE_CODE_UNIT_SHIFT) & 0xF;
+	code.isGroup = (word >> KAKU_REMOTE_CODE_GROUP_SHIFT) & 0x1;
+	code.isDim = (word >> KAKU_REMOTE_CODE_DIM_SHIFT) & 0x1;
+	code.isOn = (word >> KAKU_REMOTE_CODE_ON_SHIFT) & 0x1;
+	code.dimLevel = (word >> KAKU_REMOTE_CODE_DIMLEVEL_SHIFT) & 0xF;
+	code.isEcho = (word >> KAKU_REMOTE_CODE_ECHO_SHIFT) & 0x1;
+	code.repeat = (word >> KAKU_REMOTE_CODE_REPEAT_SHIFT) & 0xFF;
+	code.period = word >> KAKU_REMOTE_CODE_PERIOD_SHIFT;
+	return code;
+}
+#endif
+
+/**
+ * Returns whether two packed words have the same identity.
+ */
+static inline KAKU_REMOTE_CONSTEXPR bool kaku_remote_code_word_is_equal(uint64_t word1, uint64_t word2) {
+	return ((word1 ^ word2) & KAKU_REMOTE_CODE_IDENTITY_MASK) == 0;
+}
+
+/**
+ * Returns a 32 bit hash of the identity of a packed word, suitable for hash tables.
+ */
+static inline KAKU_REMOTE_CONSTEXPR uint32_t kaku_remote_code_hash(uint64_t word) {
+	return (uint32_t)(((word & KAKU_REMOTE_CODE_IDENTITY_MASK) * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+typedef struct {
+	KakuRemoteCode code;
+	int64_t timestamp;	// Time in microseconds since boot at which the stop bit of the code was captured
+	gpio_num_t gpioNum;	// The io pin on which the code was received
+} KakuRemoteEvent;
+
+typedef enum {
+	KAKU_REMOTE_ECHO_TAG,		// Codes sent by an attached transmitter are delivered with isEcho set
+	KAKU_REMOTE_ECHO_SUPPRESS	// Codes sent by an attached transmitter are dropped in the isr
+} kaku_remote_echo_mode;
+
+typedef void (*kaku_remote_rx_callback)(const KakuRemoteEvent* event, void* context);
+
 #ifdef __cplusplus
 
 class KakuRemoteReceiver {
 public:
 
 	typedef std::function<void(KakuRemoteCode)> CallBack;
+	typedef kaku_remote_rx_callback EventCallBack;
+	typedef kaku_remote_echo_mode EchoMode;
 
 	/**
 	 * Creates a new instance of a receiver for the KAKU (KlikAanKlikUit) protocol on a 433mhz receiver using the specified configuration
@@ -48,15 +161,115 @@ public:
 	KakuRemoteReceiver(gpio_num_t gpioNum);
 
 	void setEnabled(bool enabled);
+
+	/**
+	 * Registers a callback that is called from the receiver task for every decoded code.
+	 * The receiver task has its own read position, so receiveEvents and pollEvents still return every event as well.
+	 * Callbacks must be registered during setup, before codes are received, as registering is not synchronized with the receiver task.
+	 *
+	 * @param callback	The function to call for every decoded code
+	 */
 	void addCallback(CallBack callback);
 
+	/**
+	 * Registers a plain function callback that is called from the receiver task for every decoded event.
+	 * The receiver task has its own read position, so receiveEvents and pollEvents still return every event as well.
+	 * Callbacks must be registered during setup, before codes are received, as registering is not synchronized with the receiver task.
+	 *
+	 * @param callback	The function to call for every decoded event
+	 * @param context	An opaque pointer that is passed to the callback as is
+	 */
+	void addCallback(EventCallBack callback, void* context);
+
+	/**
+	 * Moves up to maxEvents decoded events into the given array, oldest first. If no events are pending, this blocks until
+	 * at least one event was decoded or until the timeout expires. Once this or pollEvents was called, events are kept until
+	 * they are received this way, so keep draining them. When the ring is full, newly decoded events are dropped.
+	 *
+	 * @param events	The array to which the events are written
+	 * @param maxEvents	The maximum number of events to write into the array
+	 * @param timeout	The maximum number of ticks to wait for an event. Use 0 to poll, or portMAX_DELAY to wait forever
+	 * @return The number of events written into the array
+	 */
+	size_t receiveEvents(KakuRemoteEvent* events, size_t maxEvents, TickType_t timeout = portMAX_DELAY);
+
+	/**
+	 * Moves up to maxEvents decoded events into the given array, oldest first, without blocking.
+	 *
+	 * @param events	The array to which the events are written
+	 * @param maxEvents	The maximum number of events to write into the array
+	 * @return The number of events written into the array
+	 */
+	size_t pollEvents(KakuRemoteEvent* events, size_t maxEvents);
+
+	/**
+	 * Sets what happens with codes that are received while an attached transmitter is sending them. Default these are suppressed.
+	 *
+	 * @param mode	Whether to tag or suppress echoed codes
+	 */
+	void setEchoMode(EchoMode mode);
+
+	/**
+	 * Marks the start of a transmission on this board. Until endTransmission is called (and shortly after), decoded codes with
+	 * the given identity are handled as echo of our own transmission. Normally this is called by an attached KakuRemoteTransmitter.
+	 *
+	 * @param identity	The identity of the code that is being sent, see kaku_remote_code_identity
+	 */
+	void beginTransmission(uint64_t identity);
+
+	/**
+	 * Marks the end of a transmission started with beginTransmission.
+	 */
+	void endTransmission();
+
+	/**
+	 * Returns whether KAKU signals from other transmitters have been seen recently. Our own transmissions are not counted.
+	 *
+	 * @param quietUs	The time in microseconds the channel must have been free of KAKU signals to be considered quiet
+	 */
+	bool isChannelBusy(uint32_t quietUs);
+
+	/**
+	 * Stops receiving and frees all resources. This waits for an isr that might still be running on the other core, and for
+	 * the receiver task to finish the callback it might be running.
+	 * The receiver must not be used by any other task (or from a callback) while it is being destructed.
+	 */
 	virtual ~KakuRemoteReceiver();
 
 private:
+	static const uint32_t EVENT_RING_SIZE = 256; // Must be a power of two
+	static const size_t DISPATCH_BATCH_SIZE = 16;
+
+	struct EventCallBackEntry {
+		EventCallBack callback;
+		void* context;
+	};
+
 	std::vector<CallBack> callbacks;
+	std::vector<EventCallBackEntry> eventCallbacks;
+
+	// Ring filled by the isr. The receiver task (once a callback is registered) and the batch consumers each have their own
+	// read position, so both get every event. Batch consumers are serialized by batchLock, which the isr never takes.
+	KakuRemoteEvent eventRing[EVENT_RING_SIZE];
+	std::atomic<uint32_t> eventRingHead;
+	std::atomic<uint32_t> batchTail;
+	std::atomic<uint32_t> dispatchTail;
+	std::atomic<bool> batchConsumer;
+	std::atomic<bool> dispatchCallbacks;
+	SemaphoreHandle_t batchLock;
+	SemaphoreHandle_t eventsAvailable;
+
+	std::atomic<bool> stopping;
+	SemaphoreHandle_t taskStopped;
+
+	portMUX_TYPE echoMux = portMUX_INITIALIZER_UNLOCKED;
+	EchoMode echoMode = KAKU_REMOTE_ECHO_SUPPRESS;
+	uint64_t echoIdentity = UINT64_MAX;
+	int64_t echoUntil = 0;
+	volatile bool transmitting = false;
+	volatile uint32_t lastActivity = 0; // Lower 32 bits of the timestamp of the last edge that was part of a KAKU signal
 
-	xQueueHandle queue;
-	KakuRemoteCode lastCode = {};
+	uint64_t lastIdentity = UINT64_MAX;
 	KakuRemoteCode currentCode = {};
 
 	int16_t state = -1;
@@ -66,8 +279,10 @@ private:
 	uint16_t min5Period;
 	uint16_t max5Period;
 	uint8_t receivedBit;
+	uint32_t addressDuration;
 	bool skipNextEdge = false;
-	volatile bool enabled = true;
+	std::atomic<bool> enabled;
+	std::atomic<int> activeInterrupts; // Number of isr invocations currently running, used to destruct safely
 
 
 	gpio_num_t gpioNum;
@@ -77,6 +292,11 @@ private:
 
 	void receive();
 	void onInterrupt();
+	void pushEvent();
+	bool isEcho(uint64_t identity);
+	void startDispatch();
+	size_t takeBatch(KakuRemoteEvent* events, size_t maxEvents);
+	size_t takeEvents(std::atomic<uint32_t>& tail, KakuRemoteEvent* events, size_t maxEvents);
 	static void receiveBootstrap(void* instance);
 	static void interruptBootstrap(void* instance);
 };
@@ -86,6 +306,75 @@ extern "C" {
 
 typedef void* kaku_remote_rx;
 
+/**
+ * Allocates the needed structures needed for receiving KAKU protocol on a 433mhz receiver on the given io pin,
+ * and returns a handle that can be used for receiving data.
+ *
+ * This handle must be freed by calling kaku_remote_rx_free
+ *
+ * @param ionum		The io pin on which the 433 receiver is attached
+ */
+kaku_remote_rx kaku_remote_rx_alloc(gpio_num_t ionum);
+
+/**
+ * Used to free all structures behind the given handle. After this call, the handle cannot be used anymore.
+ *
+ * @param handle The handle to the KAKU receiving structure
+ */
+void kaku_remote_rx_free(kaku_remote_rx handle);
+
+/**
+ * Enables or disables decoding of received signals.
+ *
+ * @param handle The handle to the KAKU receiving structure that should be used
+ * @param enabled	Whether signals should be decoded or not
+ */
+void kaku_remote_rx_set_enabled(kaku_remote_rx handle, bool enabled);
+
+/**
+ * Registers a callback that is called from the receiver task for every decoded event.
+ * The receiver task has its own read position, so polling still returns every event as well.
+ * Callbacks must be registered before codes are received, as registering is not synchronized with the receiver task.
+ *
+ * @param handle The handle to the KAKU receiving structure that should be used
+ * @param callback	The function to call for every decoded event
+ * @param context	An opaque pointer that is passed to the callback as is
+ */
+void kaku_remote_rx_add_callback(kaku_remote_rx handle, kaku_remote_rx_callback callback, void* context);
+
+/**
+ * Moves up to max_events decoded events into the given array, oldest first, without blocking.
+ *
+ * @param handle The handle to the KAKU receiving structure that should be used
+ * @param events	The array to which the events are written
+ * @param max_events	The maximum number of events to write into the array
+ * @return The number of events written into the array
+ */
+size_t kaku_remote_rx_poll(kaku_remote_rx handle, KakuRemoteEvent* events, size_t max_events);
+
+/**
+ * Moves up to max_events decoded events into the given array, oldest first. If no events are pending, this blocks until
+ * at least one event was decoded or until the timeout expires.
+ *
+ * @param handle The handle to the KAKU receiving structure that should be used
+ * @param events	The array to which the events are written
+ * @param max_events	The maximum number of events to write into the array
+ * @param timeout	The maximum number of ticks to wait for an event. Use portMAX_DELAY to wait forever
+ * @return The number of events written into the array
+ */
+size_t kaku_remote_rx_receive(kaku_remote_rx handle, KakuRemoteEvent* events, size_t max_events, TickType_t timeout);
+
+/**
+ * Sets what happens with codes that are received while an attached transmitter is sending them.
+ *
+ * @param handle The handle to the KAKU receiving structure that should be used
+ * @param mode	Whether to tag or suppress echoed codes
+ */
+void kaku_remote_rx_set_echo_mode(kaku_remote_rx handle, kaku_remote_echo_mode mode);
+
+/**
+ * Returns whether two codes have the same identity. The measured period and repeat are not compared.
+ */
 bool kaku_remote_code_is_equal(KakuRemoteCode,KakuRemoteCode);
 
 #ifdef __cplusplus
@@ -12,6 +12,9 @@
 
 #ifdef __cplusplus
 
+class KakuRemoteReceiver;
+class KakuRemoteLearner;
+
 class KakuRemoteTransmitter {
 public:
 
@@ -52,6 +55,30 @@ public:
 	 */
 	void sendDim(uint32_t address, uint8_t unit, uint8_t dimLevel);
 
+	/**
+	 * Coordinates this transmitter with a receiver on the same board. While sending, the receiver is told which code is in flight,
+	 * so it can tag or suppress the echo of our own transmission. Optionally the transmitter first waits until the receiver
+	 * has not seen any KAKU signal for a while, to avoid colliding with remotes that are already sending.
+	 *
+	 * @param receiver			The receiver to coordinate with, or nullptr to detach the current receiver
+	 * @param listenBeforeTalk	Whether to wait for a quiet channel before sending
+	 * @param quietUs			The time in microseconds the channel must have been quiet before sending. Default this is 30 milliseconds,
+	 * 							which is longer than the gap between two repeats of a code
+	 * @param maxWaitMs			The maximum time in milliseconds to wait for a quiet channel. After this, the code is sent anyway
+	 */
+	void attachReceiver(KakuRemoteReceiver* receiver, bool listenBeforeTalk = false, uint32_t quietUs = 30000, uint32_t maxWaitMs = 1000);
+
+	/**
+	 * Uses the profiles of the given learner when sending. Codes for a learned address are sent using the period measured
+	 * from that remote, and with the estimated number of repeats that remote sends (at least 3, and never more than the
+	 * repeats this transmitter was created with). The estimate counts the decoded frames of a burst plus the first frame,
+	 * which the receiver only uses to synchronize on. Until a burst of the remote completed, and for learned periods outside
+	 * of the range the learner accepts, the configured period and repeats are used. Codes for other addresses are sent as before.
+	 *
+	 * @param learner	The learner to take the profiles from, or nullptr to stop using learned profiles
+	 */
+	void setLearner(KakuRemoteLearner* learner);
+
 private:
 
 	rmt_channel_t rmtChannel;
@@ -60,14 +87,24 @@ private:
 	uint16_t periodTick;
 	uint8_t repeats;
 
-	void initializeRmt();
+	KakuRemoteReceiver* receiver = nullptr;
+	bool listenBeforeTalk = false;
+	uint32_t quietUs;
+	uint32_t maxWaitMs;
 
-	void sendStart(rmt_item32_t* items);
-	void sendStop(rmt_item32_t* items);
-	void sendAddress(rmt_item32_t* items, uint32_t address);
-	void sendUnit(rmt_item32_t* items, uint8_t unit);
-	void sendBit(rmt_item32_t* items, bool on);
-	void sendDim(rmt_item32_t* items);
+	KakuRemoteLearner* learner = nullptr;
+
+	void initializeRmt();
+	void waitForQuietChannel();
+	void resolveProfile(uint32_t address, uint16_t& periodTick, uint8_t& repeats);
+	void transmit(const rmt_item32_t* items, int numItems, uint64_t identity, uint8_t repeats);
+
+	void sendStart(rmt_item32_t* items, uint16_t periodTick);
+	void sendStop(rmt_item32_t* items, uint16_t periodTick);
+	void sendAddress(rmt_item32_t* items, uint32_t address, uint16_t periodTick);
+	void sendUnit(rmt_item32_t* items, uint8_t unit, uint16_t periodTick);
+	void sendBit(rmt_item32_t* items, bool on, uint16_t periodTick);
+	void sendDim(rmt_item32_t* items, uint16_t periodTick);
 };
 
 extern "C" {
@@ -122,6 +159,23 @@ void kaku_remote_tx_send_unit(kaku_remote_tx handle, uint32_t address, uint8_t u
  * @param dimlvl  The level to dim to (0-15)
  */
 void kaku_remote_tx_send_dim(kaku_remote_tx handle, uint32_t address, uint8_t unit, uint8_t dimlvl);
+/**
+ * Coordinates the transmitter with a receiver on the same board, so that the receiver can suppress the echo of
+ * our own transmissions, and optionally the transmitter waits for a quiet channel before sending.
+ *
+ * @param handle The handle to the KAKU transmitting structure that should be used
+ * @param rx	The handle returned by kaku_remote_rx_alloc to coordinate with, or NULL to detach
+ * @param listen_before_talk	Whether to wait (at most one second) for 30 milliseconds without KAKU signals before sending
+ */
+void kaku_remote_tx_attach_rx(kaku_remote_tx handle, void* rx, bool listen_before_talk);
+/**
+ * Uses the profiles of the given learner when sending, so codes for learned addresses are sent at the period and
+ * with the repeats of the remote that was learned.
+ *
+ * @param handle The handle to the KAKU transmitting structure that should be used
+ * @param learner	The handle returned by kaku_remote_learner_alloc, or NULL to stop using learned profiles
+ */
+void kaku_remote_tx_set_learner(kaku_remote_tx handle, void* learner);
 
 #ifdef __cplusplus
 }